@@ -0,0 +1,34 @@
+#ifndef XML_HASH_H
+#define XML_HASH_H
+
+#include <stddef.h>
+
+/* Jednoduchá hašovacia tabuľka s otvoreným adresovaním. Kľúče sa 
+ * nekopírujú - musia žiť aspoň tak dlho ako tabuľka. Vyprázdnenie je
+ * O(1) vďaka generácii platnosti záznamov */
+typedef struct {
+    unsigned long hash;
+    const void *key;
+    size_t keylen;
+    void *value;
+    unsigned gen;
+} XMLHashSlot;
+
+typedef struct {
+    XMLHashSlot *slots;
+    size_t cap;             /* mocnina dvoch */
+    size_t count;
+    unsigned gen;
+} XMLHash;
+
+unsigned long xml_hash_bytes(const void *data, size_t len);
+
+int xml_hash_init(XMLHash *h, size_t cap);
+void xml_hash_free(XMLHash *h);
+void xml_hash_clear(XMLHash *h);
+
+void *xml_hash_get(const XMLHash *h, const void *key, size_t keylen);
+void **xml_hash_slot(XMLHash *h, const void *key, size_t keylen);
+int xml_hash_remove(XMLHash *h, const void *key, size_t keylen);
+
+#endif
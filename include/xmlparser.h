@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include "bstrlib.h"
 #include "vector.h"
+#include "xmlhash.h"
 
 typedef struct {
     bstring key;
@@ -17,11 +18,149 @@ typedef struct {
     Vector *downtags; 
 } XMLTag;
 
+/* Poradie prechodu iterátora */
+#define XML_PREORDER        0
+#define XML_POSTORDER       1
+
+typedef struct {
+    XMLTag *tag;
+    size_t child;           /* index ďalšieho potomka na návštevu */
+} XMLIterFrame;
+
+/* Iterátor stromu - cesta ku koreňu je v zásobníku, nie v rekurzii */
+typedef struct {
+    Vector *stack;          /* XMLIterFrame */
+    XMLTag *root;
+    XMLTag *current;
+    size_t depth;
+    int order;
+    int started;
+} XMLIter;
+
+/* Návratové hodnoty funkcie pre xml_visit */
+#define XML_VISIT_CONTINUE  0
+#define XML_VISIT_SKIP      1   /* nezostupovať do potomkov uzla */
+#define XML_VISIT_STOP      2   /* ukončiť celý prechod */
+
+typedef int (*XMLVisitor)(XMLTag *elem, size_t depth, void *ctx);
+
+/* Úsek textu vstupu (nie je ukončený nulou) */
+typedef struct {
+    const unsigned char *data;
+    int len;
+} XMLSlice;
+
+typedef struct {
+    XMLSlice key;
+    XMLSlice value;         /* data je NULL pri prázdnej hodnote */
+} XMLAttrSlice;
+
+/* Typ udalosti čítačky */
+#define XML_EV_EOF          0
+#define XML_EV_START        1
+#define XML_EV_TEXT         2
+#define XML_EV_END          3
+
+typedef struct {
+    int type;
+    XMLSlice name;          /* START, END */
+    XMLSlice text;          /* TEXT */
+    XMLAttrSlice *attrs;    /* START */
+    size_t nattrs;
+    size_t depth;           /* hĺbka elementu, koreň má 0 */
+    int selfclosing;
+} XMLEvent;
+
+/* Stav čítačky */
+#define XML_READER_TAG      0
+#define XML_READER_TEXT     1
+#define XML_READER_END      2
+#define XML_READER_DONE     3
+
+/* Prúdová čítačka - udalosti bez budovania stromu */
+typedef struct {
+    FILE *src;
+    bstring window;         /* nespracovaná časť vstupu */
+    bstring line;
+    bstring names;          /* mená otvorených elementov za sebou */
+    Vector *open;           /* int - začiatky mien v names */
+    Vector *attrs;          /* XMLAttrSlice aktuálneho tagu */
+    int pos;
+    int eof;
+    int state;
+} XMLReader;
+
 /*typedef struct {
     int pos;
     bstring str;
 } XMLfile; */
 
+/* Súvislý blok pamäte arény */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t used;
+} XMLBlock;
+
+/* Aréna - zoznam blokov, ktoré sa pri resete nevracajú systému */
+typedef struct {
+    Vector *blocks;
+    size_t current;
+    size_t blocksize;
+} XMLArena;
+
+/* Zásobník opakovane použiteľných vektorov rovnakého typu */
+typedef struct {
+    Vector *items;
+    size_t used;
+    size_t elemsize;
+} XMLListPool;
+
+/* Záznam indexu mien - internované meno a jeho uzly v poradí dokumentu */
+typedef struct {
+    bstring name;
+    Vector *nodes;          /* Vector z XMLTag * */
+} XMLNameEntry;
+
+/* Uzly s jednou hodnotou atribútu - all vzniká až pri opakovaní */
+typedef struct {
+    XMLTag *first;
+    Vector *all;            /* Vector z XMLTag *, alebo NULL */
+} XMLAttrHit;
+
+/* Index hodnôt jedného kľúča atribútu - hodnota -> XMLAttrHit */
+typedef struct {
+    bstring key;
+    XMLHash values;
+} XMLAttrIndex;
+
+/* Dokument vlastní všetky uzly, reťazce aj vektory svojho stromu.
+ * Po xml_doc_reset (O(1)) sa úložisko použije pre ďalší parse, takže
+ * v ustálenom stave parsovanie nealokuje z haldy. Reťazce v strome
+ * dokumentu sú len na čítanie (write protected bstring). */
+typedef struct {
+    XMLTag *root;
+    bstring source;         /* normalizovaný text dokumentu */
+    bstring line;           /* pracovný buffer na čítanie riadkov */
+    XMLArena tags;          /* XMLTag */
+    XMLArena strings;       /* hlavičky struct tagbstring */
+    XMLArena bytes;         /* obsah reťazcov */
+    XMLListPool childlists; /* Vector z XMLTag * */
+    XMLListPool atriblists; /* Vector z XMLAtribut */
+    int options;            /* XML_OPT_* */
+    Vector *counts;         /* výsledok predbežného prechodu */
+    Vector *scanstack;
+    int indexes;            /* indexy vybudované posledným parse */
+    XMLArena index;         /* záznamy indexov */
+    XMLHash names;          /* meno tagu -> XMLNameEntry */
+    Vector *attrindex;      /* XMLAttrIndex pre kľúče z xml_doc_indexattr */
+} XMLDocument;
+
+/* Predbežný prechod - presná veľkosť úložiska bez realokácií */
+#define XML_OPT_PRESIZE     0x01
+/* Index mien tagov pre xml_find_by_name, mená sa internujú */
+#define XML_OPT_NAMEINDEX   0x02
+
 bstring bgetline(FILE *stream);
 bstring xml_filetostr(FILE *xmlsrc);
 
@@ -29,7 +168,39 @@ int xml_tagnamesearch(XMLTag *elem);
 void xml_tabprint(int tabs, FILE *stream, const char *fmt, ...);
 void xml_treego(XMLTag *root, FILE *stream, int (*search)(XMLTag *elem));
 
+int xml_iter_begin(XMLIter *it, XMLTag *root, int order);
+XMLTag *xml_iter_next(XMLIter *it);
+size_t xml_iter_depth(const XMLIter *it);
+void xml_iter_skip_children(XMLIter *it);
+void xml_iter_end(XMLIter *it);
+
+int xml_visit(XMLTag *root, XMLVisitor visit, void *ctx);
+XMLTag *xml_find_first(XMLTag *root, int (*match)(XMLTag *elem));
+
 XMLTag *xml_parse(FILE *xmlfile);
 void xml_freetree(XMLTag *root);
+int xml_append_child(XMLTag *parent, XMLTag *child);
+
+XMLReader *xml_reader_open(FILE *src);
+int xml_reader_next(XMLReader *r, XMLEvent *ev);
+void xml_reader_close(XMLReader *r);
+XMLTag *xml_event_tag(const XMLEvent *ev);
+void xml_freetree_async(XMLTag *root);
+void xml_reclaim_wait(void);
+
+XMLDocument *xml_doc_create(void);
+XMLTag *xml_parse_into(XMLDocument *doc, FILE *xmlfile);
+XMLTag *xml_parse_buffer(XMLDocument *doc, const char *data, size_t len);
+void xml_doc_options(XMLDocument *doc, int options);
+int xml_find_by_name(const XMLDocument *doc, const char *name, 
+                     XMLTag ***out, size_t *n);
+int xml_doc_indexattr(XMLDocument *doc, const char *key);
+XMLTag *xml_find_by_attr(const XMLDocument *doc, const char *key, 
+                         const char *value);
+int xml_find_all_by_attr(const XMLDocument *doc, const char *key, 
+                         const char *value, XMLTag ***out, size_t *n);
+void xml_doc_reset(XMLDocument *doc);
+void xml_doc_release(XMLDocument *doc);
+void xml_doc_release_async(XMLDocument *doc);
 
 #endif
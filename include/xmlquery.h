@@ -0,0 +1,57 @@
+#ifndef XML_QUERY_H
+#define XML_QUERY_H
+
+#include <stdio.h>
+#include "bstrlib.h"
+#include "vector.h"
+#include "xmlparser.h"
+
+/* Os kroku */
+#define XML_AXIS_CHILD          0   /* /name */
+#define XML_AXIS_DESCENDANT     1   /* //name */
+
+/* Typ predikátu */
+#define XML_PRED_HASATTR        0   /* [@key] */
+#define XML_PRED_ATTR           1   /* [@key='value'] */
+#define XML_PRED_POSITION       2   /* [n], od 1 */
+
+typedef struct {
+    int type;
+    bstring key;
+    bstring value;
+    size_t position;
+} XMLPredicate;
+
+typedef struct {
+    int axis;
+    bstring name;           /* NULL pre '*' */
+    Vector *preds;          /* Vector z XMLPredicate */
+} XMLStep;
+
+/* Skompilovaný dotaz - podmnožina XPath:
+ *   /library/book[@lang='en']/title, //p[1], //book[2]/title, //a[@id]
+ * Absolútny dotaz začína nad koreňom stromu (ako pri dokumentovom uzle),
+ * relatívny pri potomkoch kontextového uzla. Pozičný predikát čísluje
+ * uzly vybrané krokom z jedného kontextového uzla */
+typedef struct {
+    int absolute;
+    Vector *steps;          /* Vector z XMLStep */
+} XMLQuery;
+
+XMLQuery *xml_query_compile(const char *expr);
+void xml_query_free(XMLQuery *query);
+
+int xml_query_run(const XMLQuery *query, XMLTag *context,
+                  const XMLDocument *doc, Vector *out);
+XMLTag *xml_query_first(const XMLQuery *query, XMLTag *context,
+                        const XMLDocument *doc);
+
+int xml_match_step(const XMLStep *step, XMLTag *elem);
+
+/* Funkcia pre prúdové zhody - dostane podstrom do vlastníctva */
+typedef int (*XMLMatchFn)(XMLTag *match, void *ctx);
+
+long xml_query_stream(const XMLQuery *query, FILE *src, 
+                      XMLMatchFn onmatch, void *ctx);
+
+#endif
@@ -0,0 +1,158 @@
+/* 
+ * xmlhash.c 
+ * Hašovacia tabuľka pre indexy dokumentu (mená tagov, hodnoty atribútov)
+ *
+ * Licencia: MIT / LGPLv2
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "xmlhash.h"
+
+#define XML_HASH_MINCAP     16
+
+static XMLHashSlot *hash_find(const XMLHash *h, unsigned long hash, 
+                              const void *key, size_t keylen);
+static int hash_grow(XMLHash *h);
+
+/* FNV-1a */
+unsigned long xml_hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    unsigned long hash = 2166136261UL;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+int xml_hash_init(XMLHash *h, size_t cap)
+{
+    size_t n = XML_HASH_MINCAP;
+
+    while (n < cap * 2)
+        n <<= 1;
+    h->slots = calloc(n, sizeof(XMLHashSlot));
+    h->cap = h->slots ? n : 0;
+    h->count = 0;
+    h->gen = 1;
+    return h->slots ? 0 : -1;
+}
+
+void xml_hash_free(XMLHash *h)
+{
+    free(h->slots);
+    h->slots = NULL;
+    h->cap = h->count = 0;
+}
+
+/* Záznamy so starou generáciou sa považujú za prázdne */
+void xml_hash_clear(XMLHash *h)
+{
+    h->count = 0;
+    if (++h->gen == 0) {
+        memset(h->slots, 0, h->cap * sizeof(XMLHashSlot));
+        h->gen = 1;
+    }
+}
+
+void *xml_hash_get(const XMLHash *h, const void *key, size_t keylen)
+{
+    XMLHashSlot *slot;
+
+    if (h->cap == 0)
+        return NULL;
+    slot = hash_find(h, xml_hash_bytes(key, keylen), key, keylen);
+    return slot->gen == h->gen ? slot->value : NULL;
+}
+
+/* Ukazateľ na hodnotu kľúča - nový kľúč dostane hodnotu NULL. 
+ * Vráti NULL ak chýba pamäť */
+void **xml_hash_slot(XMLHash *h, const void *key, size_t keylen)
+{
+    unsigned long hash = xml_hash_bytes(key, keylen);
+    XMLHashSlot *slot;
+
+    if ((h->count + 1) * 2 > h->cap && hash_grow(h) != 0)
+        return NULL;
+
+    slot = hash_find(h, hash, key, keylen);
+    if (slot->gen != h->gen) {
+        slot->hash = hash;
+        slot->key = key;
+        slot->keylen = keylen;
+        slot->value = NULL;
+        slot->gen = h->gen;
+        h->count++;
+    }
+    return &slot->value;
+}
+
+/* Odstránenie so spätným posunom, aby nevznikali náhrobky */
+int xml_hash_remove(XMLHash *h, const void *key, size_t keylen)
+{
+    XMLHashSlot *slot;
+    size_t i, j, home;
+
+    if (h->cap == 0)
+        return -1;
+    slot = hash_find(h, xml_hash_bytes(key, keylen), key, keylen);
+    if (slot->gen != h->gen)
+        return -1;
+
+    i = slot - h->slots;
+    for (j = (i + 1) & (h->cap - 1); h->slots[j].gen == h->gen; 
+         j = (j + 1) & (h->cap - 1)) {
+        home = h->slots[j].hash & (h->cap - 1);
+        /* záznam j môže ísť na miesto i, ak i leží medzi home a j */
+        if ((j > i && (home <= i || home > j)) 
+            || (j < i && (home <= i && home > j))) {
+            h->slots[i] = h->slots[j];
+            i = j;
+        }
+    }
+    h->slots[i].gen = h->gen - 1;
+    h->count--;
+    return 0;
+}
+
+static XMLHashSlot *hash_find(const XMLHash *h, unsigned long hash, 
+                              const void *key, size_t keylen)
+{
+    size_t i = hash & (h->cap - 1);
+    XMLHashSlot *slot;
+
+    for (;;) {
+        slot = &h->slots[i];
+        if (slot->gen != h->gen)
+            return slot;
+        if (slot->hash == hash && slot->keylen == keylen
+            && memcmp(slot->key, key, keylen) == 0)
+            return slot;
+        i = (i + 1) & (h->cap - 1);
+    }
+}
+
+static int hash_grow(XMLHash *h)
+{
+    XMLHash bigger;
+    XMLHashSlot *slot;
+    size_t i;
+
+    if (xml_hash_init(&bigger, h->cap) != 0)
+        return -1;
+    for (i = 0; i < h->cap; i++) {
+        if (h->slots[i].gen != h->gen)
+            continue;
+        slot = hash_find(&bigger, h->slots[i].hash, h->slots[i].key, 
+                         h->slots[i].keylen);
+        *slot = h->slots[i];
+        slot->gen = bigger.gen;
+        bigger.count++;
+    }
+    free(h->slots);
+    *h = bigger;
+    return 0;
+}
@@ -13,7 +13,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "xmlparser.h"
+#include "xmlhash.h"
 #include "bstrlib.h"
 #include "vector.h"
 
@@ -21,19 +23,76 @@
    tj. prakticky sa zatiaľ nedá podporovať multithreading */
 static long g_filepos;
 static bstring g_xmltext;
+/* Dokument, z ktorého úložiska sa berú uzly (NULL - bežný malloc) */
+static XMLDocument *g_doc;
+
+/* Počty z predbežného prechodu pre aktuálny parse (NULL - bez neho) */
+static Vector *g_counts;
+static size_t g_tagno;
+/* Záznam indexu mien pre posledný otvárací tag (XML_OPT_NAMEINDEX) */
+static XMLNameEntry *g_nameentry;
+
+/* Vlákno, ktoré na pozadí uvoľňuje stromy a dokumenty */
+typedef struct {
+    XMLTag *root;
+    XMLDocument *doc;
+} XMLReclaimItem;
+
+static pthread_once_t g_reclaim_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_reclaim_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_reclaim_idle = PTHREAD_COND_INITIALIZER;
+static Vector *g_reclaim_queue;
+static int g_reclaim_busy;
+static int g_reclaim_started;
+
+#define XML_BLOCKSIZE       (64 * 1024)
+#define XML_ALIGN(N)        (((N) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/* Počet potomkov a atribútov otváracieho tagu zistený pri predbežnom 
+ * prechode - podľa poradia tagov v dokumente */
+typedef struct {
+    size_t children;
+    size_t atributes;
+} XMLCounts;
 
 #define istag_closing(TAGNAME)      \
     (bchar((TAGNAME), 0) == '/' ? 1 : 0)
 
 /* Lokálne funkcie - prototypy */
-static bstring xml_getlextoken(char teminator);
+static int xml_lexslice(char terminator, int *beg);
+static int xml_gettoken(char terminator, int *beg);
+static bstring xml_newname(const unsigned char *s, int len);
 static bstring xml_gettag(void);
-static Vector *xml_atributelist(void);
+static Vector *xml_atributelist(XMLTag *owner, size_t hint);
+static int xml_attrslice(int *kbeg, int *klen, int *vbeg, int *vlen);
+static void xml_indexattr(XMLTag *owner, const XMLAtribut *kv);
 static bstring xml_tagtext(void);
 static XMLTag *xml_buildtree(void);
 static XMLTag *xml_taginit(void); 
+static bstring xml_newstr(const unsigned char *s, int len);
+static Vector *xml_newlist(int atributes, size_t hint);
+static void xml_droptag(XMLTag *tag);
+static void xml_readsource(bstring dst, bstring line, FILE *src);
+static void xml_readbuffer(bstring dst, const char *data, size_t len);
+static XMLTag *xml_builddoc(XMLDocument *doc);
+static void xml_prescan(XMLDocument *doc);
+static void arena_init(XMLArena *arena, size_t blocksize);
+static void *arena_alloc(XMLArena *arena, size_t size);
+static void arena_reserve(XMLArena *arena, size_t size);
+static void arena_reset(XMLArena *arena);
+static void arena_release(XMLArena *arena);
+static void listpool_init(XMLListPool *pool, size_t elemsize);
+static void listpool_release(XMLListPool *pool);
+static int reader_fill(XMLReader *r, char delim, int from);
+static void reader_compact(XMLReader *r);
+static void reader_pop(XMLReader *r);
+static void xml_reclaim(XMLTag *root, XMLDocument *doc);
+static void reclaim_start(void);
+static void *reclaim_thread(void *arg);
 static void delete_tag(void *item);
 static void delete_xmlatrib(void *data);
+static void delete_attrindex(void *data);
 static void print_error(const char *fmt, ...);
 
 bstring bgetline(FILE *stream) 
@@ -71,6 +130,186 @@ XMLTag *xml_parse(FILE *xmlfile)
     return tg;
 }
 
+XMLDocument *xml_doc_create(void)
+{
+    XMLDocument *doc = malloc(sizeof(XMLDocument));
+    if (doc == NULL)
+        return NULL;
+
+    doc->root = NULL;
+    doc->source = bfromcstr("");
+    doc->line = bfromcstr("");
+    arena_init(&doc->tags, XML_BLOCKSIZE);
+    arena_init(&doc->strings, XML_BLOCKSIZE);
+    arena_init(&doc->bytes, XML_BLOCKSIZE);
+    listpool_init(&doc->childlists, sizeof(XMLTag *));
+    listpool_init(&doc->atriblists, sizeof(XMLAtribut));
+    doc->options = 0;
+    doc->indexes = 0;
+    arena_init(&doc->index, XML_BLOCKSIZE);
+    xml_hash_init(&doc->names, 0);
+    doc->attrindex = vector_create(0, sizeof(XMLAttrIndex), delete_attrindex);
+    doc->counts = vector_create(0, sizeof(XMLCounts), NULL);
+    doc->scanstack = vector_create(0, sizeof(size_t), NULL);
+
+    if (doc->source == NULL || doc->line == NULL || doc->tags.blocks == NULL
+        || doc->counts == NULL || doc->scanstack == NULL 
+        || doc->index.blocks == NULL || doc->names.slots == NULL
+        || doc->attrindex == NULL
+        || doc->strings.blocks == NULL || doc->bytes.blocks == NULL
+        || doc->childlists.items == NULL || doc->atriblists.items == NULL) {
+        xml_doc_release(doc);
+        return NULL;
+    }
+    return doc;
+}
+
+/* Zahodí predchádzajúci strom, ale ponechá si všetku jeho pamäť */
+void xml_doc_reset(XMLDocument *doc)
+{
+    size_t i;
+
+    doc->root = NULL;
+    arena_reset(&doc->tags);
+    arena_reset(&doc->strings);
+    arena_reset(&doc->bytes);
+    doc->childlists.used = 0;
+    doc->atriblists.used = 0;
+    arena_reset(&doc->index);
+    xml_hash_clear(&doc->names);
+    for (i = 0; i < vector_count(doc->attrindex); i++)
+        xml_hash_clear(&((XMLAttrIndex *)vector_at(doc->attrindex, i))->values);
+}
+
+/* Ako xml_parse, ale strom vybuduje v úložisku dokumentu. Predošlý strom
+ * dokumentu prestáva platiť. Strom sa neuvoľňuje cez xml_freetree */
+XMLTag *xml_parse_into(XMLDocument *doc, FILE *xmlfile)
+{
+    xml_doc_reset(doc);
+    xml_readsource(doc->source, doc->line, xmlfile);
+    return xml_builddoc(doc);
+}
+
+/* Parse dokumentu, ktorý je už celý v pamäti */
+XMLTag *xml_parse_buffer(XMLDocument *doc, const char *data, size_t len)
+{
+    xml_doc_reset(doc);
+    xml_readbuffer(doc->source, data, len);
+    return xml_builddoc(doc);
+}
+
+/* Všetky uzly s menom name v poradí dokumentu - jediné vyhľadanie 
+ * v indexe mien. Vráti -1, ak dokument nebol parsovaný s indexom */
+int xml_find_by_name(const XMLDocument *doc, const char *name, 
+                     XMLTag ***out, size_t *n)
+{
+    XMLNameEntry *entry;
+
+    *out = NULL;
+    *n = 0;
+    if (!(doc->indexes & XML_OPT_NAMEINDEX))
+        return -1;
+
+    entry = xml_hash_get(&doc->names, name, strlen(name));
+    if (entry != NULL && !vector_empty(entry->nodes)) {
+        *out = vector_data(entry->nodes);
+        *n = vector_count(entry->nodes);
+    }
+    return 0;
+}
+
+/* Zapne index hodnôt atribútu key - platí od nasledujúceho parse */
+int xml_doc_indexattr(XMLDocument *doc, const char *key)
+{
+    XMLAttrIndex idx;
+    size_t i;
+
+    for (i = 0; i < vector_count(doc->attrindex); i++) {
+        if (biseqcstr(((XMLAttrIndex *)vector_at(doc->attrindex, i))->key, 
+                      key))
+            return 0;
+    }
+
+    idx.key = bfromcstr(key);
+    if (idx.key == NULL || xml_hash_init(&idx.values, 0) != 0) {
+        bdestroy(idx.key);
+        return -1;
+    }
+    xml_hash_clear(&idx.values);
+    vector_push_back(doc->attrindex, &idx);
+    return 0;
+}
+
+/* Prvý uzol s atribútom key="value" - očakávane O(1). NULL ak taký nie
+ * je alebo key nie je indexovaný */
+XMLTag *xml_find_by_attr(const XMLDocument *doc, const char *key, 
+                         const char *value)
+{
+    XMLTag **out;
+    size_t n;
+
+    xml_find_all_by_attr(doc, key, value, &out, &n);
+    return n > 0 ? out[0] : NULL;
+}
+
+/* Všetky uzly s atribútom key="value" v poradí dokumentu. Vráti -1, ak
+ * kľúč nie je indexovaný */
+int xml_find_all_by_attr(const XMLDocument *doc, const char *key, 
+                         const char *value, XMLTag ***out, size_t *n)
+{
+    XMLAttrIndex *idx;
+    XMLAttrHit *hit;
+    size_t i;
+
+    *out = NULL;
+    *n = 0;
+    for (i = 0; i < vector_count(doc->attrindex); i++) {
+        idx = vector_at(doc->attrindex, i);
+        if (!biseqcstr(idx->key, key))
+            continue;
+        hit = xml_hash_get(&idx->values, value, strlen(value));
+        if (hit == NULL) 
+            return 0;
+        if (hit->all == NULL) {
+            *out = &hit->first;
+            *n = 1;
+        } else {
+            *out = vector_data(hit->all);
+            *n = vector_count(hit->all);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* Voľby dokumentu (XML_OPT_*) platia od nasledujúceho parse */
+void xml_doc_options(XMLDocument *doc, int options)
+{
+    doc->options = options;
+}
+
+void xml_doc_release(XMLDocument *doc)
+{
+    if (doc == NULL)
+        return;
+    bdestroy(doc->source);
+    bdestroy(doc->line);
+    arena_release(&doc->tags);
+    arena_release(&doc->strings);
+    arena_release(&doc->bytes);
+    listpool_release(&doc->childlists);
+    listpool_release(&doc->atriblists);
+    arena_release(&doc->index);
+    xml_hash_free(&doc->names);
+    if (doc->attrindex != NULL)
+        vector_release(doc->attrindex);
+    if (doc->counts != NULL)
+        vector_release(doc->counts);
+    if (doc->scanstack != NULL)
+        vector_release(doc->scanstack);
+    free(doc);
+}
+
 void xml_tabprint(int tabs, FILE *stream, const char *fmt, ...)
 {
     va_list argum;
@@ -101,47 +340,424 @@ int xml_tagnamesearch(XMLTag *elem)
  *                            zobrazí sa všetko */
 void xml_treego(XMLTag *root, FILE *stream, int (*search)(XMLTag *elem))
 {
-    static int treelvl = 0; 
-    size_t i;
-    int display = 1;
-    XMLTag **tagiter;  
+    XMLIter it;
+    XMLTag *tag;
+    size_t i, lvl;
     XMLAtribut *atriter;
 
-    if (root == NULL) 
+    if (root == NULL || xml_iter_begin(&it, root, XML_PREORDER) != 0) 
         return;
     
-    if (search != NULL) 
-        display = search(root);
-
-    if (display) {
-        xml_tabprint(treelvl, stream, "Element: %s", bdata(root->tagname));
-        if (root->atribut != NULL) {        
-            for (i = 0; i < vector_count(root->atribut); i++) {
-                atriter = vector_at(root->atribut, i);
-                xml_tabprint(treelvl, stream, "Key: %s; Value: %s", 
+    while ((tag = xml_iter_next(&it)) != NULL) {
+        if (search != NULL && !search(tag)) 
+            continue;
+
+        lvl = xml_iter_depth(&it);
+        xml_tabprint(lvl, stream, "Element: %s", bdata(tag->tagname));
+        if (tag->atribut != NULL) {        
+            for (i = 0; i < vector_count(tag->atribut); i++) {
+                atriter = vector_at(tag->atribut, i);
+                xml_tabprint(lvl, stream, "Key: %s; Value: %s", 
                         bdata(atriter->key), bdata(atriter->value));
             }
         }
 
-        if (root->text != NULL) {
-            xml_tabprint(treelvl, stream, "Text: %s", bdata(root->text));
+        if (tag->text != NULL) {
+            xml_tabprint(lvl, stream, "Text: %s", bdata(tag->text));
         }
     }
+    xml_iter_end(&it);
+} 
+
+/* Iterátor stromu bez rekurzie a bez globálneho stavu - cesta od koreňa
+ * k aktuálnemu uzlu je na explicitnom zásobníku. Vráti 0, alebo -1 ak
+ * chýba pamäť */
+int xml_iter_begin(XMLIter *it, XMLTag *root, int order)
+{
+    XMLIterFrame frame;
+
+    it->stack = vector_create(0, sizeof(XMLIterFrame), NULL);
+    if (it->stack == NULL)
+        return -1;
+    it->order = order;
+    it->root = root;
+    it->current = NULL;
+    it->depth = 0;
+    it->started = 0;
+
+    /* post-order začína zostupom od koreňa */
+    if (order == XML_POSTORDER && root != NULL) {
+        frame.tag = root;
+        frame.child = 0;
+        vector_push_back(it->stack, &frame);
+    }
+    return 0;
+}
+
+/* Vráti ďalší uzol v zvolenom poradí, alebo NULL na konci */
+XMLTag *xml_iter_next(XMLIter *it)
+{
+    XMLIterFrame frame, *top;
+
+    if (it->order == XML_PREORDER && !it->started) {
+        it->started = 1;
+        if (it->root == NULL)
+            return NULL;
+        frame.tag = it->root;
+        frame.child = 0;
+        vector_push_back(it->stack, &frame);
+        it->depth = 0;
+        return it->current = it->root;
+    }
 
-    if (root->downtags != NULL) {
-        for (i = 0; i < vector_count(root->downtags); i++) {
-            tagiter = vector_at(root->downtags, i);
-            treelvl++;
-            xml_treego(*tagiter, stream, search);
-            treelvl--;
+    while (!vector_empty(it->stack)) {
+        top = vector_back(it->stack);
+        if (top->tag->downtags != NULL 
+            && top->child < vector_count(top->tag->downtags)) {
+            frame.tag = *(XMLTag **)vector_at(top->tag->downtags, 
+                                              top->child++);
+            frame.child = 0;
+            vector_push_back(it->stack, &frame);
+            if (it->order == XML_PREORDER) {
+                it->depth = vector_count(it->stack) - 1;
+                return it->current = frame.tag;
+            }
+            continue;
         }
+
+        /* všetci potomkovia vybavení */
+        it->depth = vector_count(it->stack) - 1;
+        it->current = top->tag;
+        vector_pop_back(it->stack);
+        if (it->order == XML_POSTORDER)
+            return it->current;
+    }
+    return it->current = NULL;
+}
+
+/* Hĺbka naposledy vráteného uzla (koreň má 0) */
+size_t xml_iter_depth(const XMLIter *it)
+{
+    return it->depth;
+}
+
+/* Pri pre-order nezostúpi do potomkov naposledy vráteného uzla */
+void xml_iter_skip_children(XMLIter *it)
+{
+    XMLIterFrame *top;
+
+    if (it->order != XML_PREORDER || vector_empty(it->stack))
+        return;
+    top = vector_back(it->stack);
+    if (top->tag == it->current && top->tag->downtags != NULL)
+        top->child = vector_count(top->tag->downtags);
+}
+
+/* Ukončí prechod (aj predčasne) a uvoľní zásobník */
+void xml_iter_end(XMLIter *it)
+{
+    if (it->stack != NULL)
+        vector_release(it->stack);
+    it->stack = NULL;
+    it->current = NULL;
+}
+
+/* Pre-order návšteva stromu - funkcia visit rozhoduje pre každý uzol:
+ * XML_VISIT_CONTINUE, XML_VISIT_SKIP (bez potomkov) alebo XML_VISIT_STOP.
+ * Vráti 1 ak prechod zastavil visit, 0 po celom strome, -1 bez pamäte */
+int xml_visit(XMLTag *root, XMLVisitor visit, void *ctx)
+{
+    XMLIter it;
+    XMLTag *tag;
+    int action = XML_VISIT_CONTINUE;
+
+    if (root == NULL)
+        return 0;
+    if (xml_iter_begin(&it, root, XML_PREORDER) != 0)
+        return -1;
+
+    while ((tag = xml_iter_next(&it)) != NULL) {
+        action = visit(tag, xml_iter_depth(&it), ctx);
+        if (action == XML_VISIT_STOP)
+            break;
+        if (action == XML_VISIT_SKIP)
+            xml_iter_skip_children(&it);
+    }
+    xml_iter_end(&it);
+    return action == XML_VISIT_STOP;
+}
+
+typedef struct {
+    int (*match)(XMLTag *elem);
+    XMLTag *found;
+} XMLFindCtx;
+
+static int find_visitor(XMLTag *elem, size_t depth, void *ctx)
+{
+    XMLFindCtx *find = ctx;
+    (void)depth;
+
+    if (!find->match(elem))
+        return XML_VISIT_CONTINUE;
+    find->found = elem;
+    return XML_VISIT_STOP;
+}
+
+/* Prvý uzol v poradí dokumentu, pre ktorý match vráti nenulu - napr.
+ * xml_find_first(root, xml_tagnamesearch). Prechod končí na zhode */
+XMLTag *xml_find_first(XMLTag *root, int (*match)(XMLTag *elem))
+{
+    XMLFindCtx find;
+
+    find.match = match;
+    find.found = NULL;
+    xml_visit(root, find_visitor, &find);
+    return find.found;
+}
+
+/* Pripojí uzol ako posledného potomka */
+int xml_append_child(XMLTag *parent, XMLTag *child)
+{
+    if (parent->downtags == NULL 
+        && (parent->downtags = vector_create(0, sizeof(XMLTag *), NULL)) 
+        == NULL)
+        return -1;
+    return vector_push_back(parent->downtags, &child) ? 0 : -1;
+}
+
+/* Čítačka udalostí - ten istý lexer ako xml_buildtree, ale nad oknom
+ * vstupu, ktoré sa dopĺňa po riadkoch a zahadzuje prečítaný začiatok.
+ * Pamäť teda nerastie s veľkosťou vstupu, iba s najdlhším tagom a
+ * hĺbkou stromu */
+XMLReader *xml_reader_open(FILE *src)
+{
+    XMLReader *r = malloc(sizeof(XMLReader));
+    if (r == NULL)
+        return NULL;
+
+    r->src = src;
+    r->window = bfromcstr("");
+    r->line = bfromcstr("");
+    r->names = bfromcstr("");
+    r->open = vector_create(0, sizeof(int), NULL);
+    r->attrs = vector_create(0, sizeof(XMLAttrSlice), NULL);
+    r->pos = 0;
+    r->eof = 0;
+    r->state = XML_READER_TAG;
+    if (r->window == NULL || r->line == NULL || r->names == NULL
+        || r->open == NULL || r->attrs == NULL) {
+        xml_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void xml_reader_close(XMLReader *r)
+{
+    if (r == NULL)
+        return;
+    bdestroy(r->window);
+    bdestroy(r->line);
+    bdestroy(r->names);
+    if (r->open != NULL)
+        vector_release(r->open);
+    if (r->attrs != NULL)
+        vector_release(r->attrs);
+    free(r);
+}
+
+/* Ďalšia udalosť - XML_EV_START, XML_EV_TEXT, XML_EV_END alebo XML_EV_EOF
+ * po uzavretí koreňa. Úseky v ev platia do ďalšieho volania. Syntaktické
+ * chyby sa hlásia rovnako ako pri xml_parse */
+int xml_reader_next(XMLReader *r, XMLEvent *ev)
+{
+    int lt, beg, len, top, kbeg, vbeg;
+    XMLAttrSlice atr;
+
+    reader_compact(r);
+    g_xmltext = r->window;
+    ev->nattrs = 0;
+    ev->attrs = NULL;
+    ev->selfclosing = 0;
+
+    switch (r->state) {
+    case XML_READER_DONE:
+        return ev->type = XML_EV_EOF;
+
+    case XML_READER_END:    /* koniec samouzatváracieho tagu */
+        top = *(int *)vector_back(r->open);
+        ev->name.data = r->names->data + top;
+        ev->name.len = blength(r->names) - top;
+        reader_pop(r);
+        ev->depth = vector_count(r->open);
+        r->state = ev->depth ? XML_READER_TAG : XML_READER_DONE;
+        return ev->type = XML_EV_END;
+
+    case XML_READER_TEXT:   /* text hneď za otváracím tagom */
+        r->state = XML_READER_TAG;
+        lt = reader_fill(r, '<', r->pos);
+        if (lt == BSTR_ERR)
+            lt = blength(r->window);
+        if (lt > r->pos) {
+            ev->text.data = r->window->data + r->pos;
+            ev->text.len = lt - r->pos;
+            ev->depth = vector_count(r->open) - 1;
+            r->pos = lt;
+            return ev->type = XML_EV_TEXT;
+        }
+        break;
+    }
+
+    for (;;) {
+        if ((lt = reader_fill(r, '<', r->pos)) == BSTR_ERR) {
+            if (vector_count(r->open) > 0) {
+                g_filepos = blength(r->window);
+                print_error("Chyba: Neocakavany koniec suboru\n");
+                exit(1);
+            }
+            r->state = XML_READER_DONE;
+            return ev->type = XML_EV_EOF;
+        }
+        r->pos = lt + 1;
+        if (reader_fill(r, '>', r->pos) == BSTR_ERR) {
+            g_filepos = r->pos;
+            print_error("Chyba: Neocakavany koniec suboru\n");
+            exit(1);
+        }
+
+        /* Preskoč deklaratívne tagy !-- , ?xml */
+        if (bchar(r->window, r->pos) != '!' && bchar(r->window, r->pos) != '?')
+            break;
+    }
+
+    g_xmltext = r->window;
+    g_filepos = r->pos;
+    if ((len = xml_gettoken(' ', &beg)) < 0) {
+        print_error("Chyba: Nedostatok pamate/ Neocakavany EOF\n");
+        exit(1);
     }
-} 
 
+    if (r->window->data[beg] == '/') {
+        top = vector_empty(r->open) ? 0 : *(int *)vector_back(r->open);
+        if (vector_empty(r->open) || len - 1 != blength(r->names) - top
+            || memcmp(r->window->data + beg + 1, r->names->data + top, 
+                      len - 1) != 0) {
+            print_error("Chyba - tag mismatch: '<%.*s>' je zatvoreny "
+                        "ale posledny otvoreny je '<%s>'\n", len - 1,
+                        r->window->data + beg + 1, 
+                        vector_empty(r->open) ? "" : bdata(r->names) + top);
+            exit(1);
+        }
+        ev->name.data = r->window->data + beg + 1;
+        ev->name.len = len - 1;
+        r->pos = g_filepos;
+        reader_pop(r);
+        ev->depth = vector_count(r->open);
+        if (ev->depth == 0)
+            r->state = XML_READER_DONE;
+        return ev->type = XML_EV_END;
+    }
+
+    vector_clear(r->attrs);
+    while (xml_attrslice(&kbeg, &atr.key.len, &vbeg, &atr.value.len) > 0) {
+        atr.key.data = r->window->data + kbeg;
+        atr.value.data = atr.value.len < 0 ? NULL : r->window->data + vbeg;
+        vector_push_back(r->attrs, &atr);
+    }
+
+    g_filepos = bstrchrp(r->window, '>', g_filepos);
+    ev->selfclosing = bchar(r->window, g_filepos - 1) == '/';
+    ev->name.data = r->window->data + beg;
+    ev->name.len = len;
+    ev->attrs = vector_empty(r->attrs) ? NULL : vector_data(r->attrs);
+    ev->nattrs = vector_count(r->attrs);
+    ev->depth = vector_count(r->open);
+    r->pos = g_filepos + 1;
+
+    /* meno si treba pamätať kvôli kontrole uzatváracieho tagu */
+    top = blength(r->names);
+    vector_push_back(r->open, &top);
+    bcatblk(r->names, ev->name.data, len);
+    r->state = ev->selfclosing ? XML_READER_END : XML_READER_TEXT;
+    return ev->type = XML_EV_START;
+}
+
+/* Uzol (bez potomkov) z udalosti XML_EV_START - uvoľní sa xml_freetree */
+XMLTag *xml_event_tag(const XMLEvent *ev)
+{
+    XMLTag *tag = malloc(sizeof(XMLTag));
+    XMLAtribut kv;
+    size_t i;
+
+    if (tag == NULL)
+        return NULL;
+    tag->tagname = blk2bstr(ev->name.data, ev->name.len);
+    tag->atribut = NULL;
+    tag->text = NULL;
+    tag->downtags = NULL;
+    if (ev->nattrs > 0)
+        tag->atribut = vector_create(ev->nattrs, sizeof(XMLAtribut), 
+                                     delete_xmlatrib);
+    for (i = 0; i < ev->nattrs; i++) {
+        kv.key = blk2bstr(ev->attrs[i].key.data, ev->attrs[i].key.len);
+        kv.value = ev->attrs[i].value.data == NULL ? NULL 
+                 : blk2bstr(ev->attrs[i].value.data, ev->attrs[i].value.len);
+        vector_push_back(tag->atribut, &kv);
+    }
+    if (!ev->selfclosing)
+        tag->downtags = vector_create(0, sizeof(XMLTag *), NULL);
+    return tag;
+}
+
+/* Uvoľnenie bez rekurzie - potomkovia idú na explicitný zásobník, 
+ * takže ani veľmi hlboký strom nepretečie zásobník volaní */
 void xml_freetree(XMLTag *root)
+{
+    Vector *stack;
+    XMLTag *tag;
+
+    if (root == NULL)
+        return;
+    
+    stack = vector_create(0, sizeof(XMLTag *), NULL);
+    if (stack == NULL)
+        return;
+
+    vector_push_back(stack, &root);
+    while (!vector_empty(stack)) {
+        tag = *(XMLTag **)vector_back(stack);
+        vector_pop_back(stack);
+        if (tag->downtags != NULL) 
+            vector_append(stack, vector_data(tag->downtags), 
+                          vector_count(tag->downtags));
+        delete_tag(&tag);
+    }
+    vector_release(stack);
+}
+
+/* Odovzdá strom vláknu na pozadí - volajúci sa vráti okamžite. Ak 
+ * vlákno nemožno spustiť, strom sa uvoľní hneď */
+void xml_freetree_async(XMLTag *root)
 {
     if (root != NULL)
-        delete_tag(&root);      
+        xml_reclaim(root, NULL);
+}
+
+/* Ako xml_freetree_async, pre dokument aj s jeho úložiskom */
+void xml_doc_release_async(XMLDocument *doc)
+{
+    if (doc != NULL)
+        xml_reclaim(NULL, doc);
+}
+
+/* Počká, kým vlákno na pozadí neuvoľní všetko, čo dostalo */
+void xml_reclaim_wait(void)
+{
+    pthread_mutex_lock(&g_reclaim_lock);
+    while (g_reclaim_busy || (g_reclaim_queue != NULL 
+                              && !vector_empty(g_reclaim_queue)))
+        pthread_cond_wait(&g_reclaim_idle, &g_reclaim_lock);
+    pthread_mutex_unlock(&g_reclaim_lock);
 }
 
 static void print_error(const char *fmt, ...)
@@ -168,6 +784,7 @@ static void print_error(const char *fmt, ...)
 static XMLTag *xml_buildtree(void) 
 {
     XMLTag *tag, *down;
+    XMLCounts *cnt = NULL;
 
     if (g_xmltext == NULL || g_xmltext->data == NULL || g_xmltext->slen <= 0 
         || g_xmltext->slen <= g_filepos || g_filepos < 0) {
@@ -186,7 +803,14 @@ static XMLTag *xml_buildtree(void)
         return tag;
     }
 
-    tag->atribut = xml_atributelist();
+    if (g_counts != NULL && g_tagno < vector_count(g_counts))
+        cnt = vector_at(g_counts, g_tagno);
+    ++g_tagno;
+
+    if (g_nameentry != NULL)
+        vector_push_back(g_nameentry->nodes, &tag);
+
+    tag->atribut = xml_atributelist(tag, cnt ? cnt->atributes : 0);
     
     g_filepos = bstrchrp(g_xmltext, '>', g_filepos);
     if (g_filepos == BSTR_ERR || bchar(g_xmltext, g_filepos + 1) == '\0') {
@@ -202,7 +826,7 @@ static XMLTag *xml_buildtree(void)
     tag->text = xml_tagtext();
 
       /* Rekurzia dole po strome */
-     tag->downtags = vector_create(0, sizeof(XMLTag *), delete_tag);
+     tag->downtags = xml_newlist(0, cnt ? cnt->children : 0);
      for(;;) {
         down = xml_buildtree();
         if (down == NULL)
@@ -210,75 +834,129 @@ static XMLTag *xml_buildtree(void)
         /* putchar('\n');xml_treetravel(down);,putchar('\n');
          * -- Zapnúť ak chceme vidieť vytváranie stromu*/ 
         if (istag_closing(down->tagname)) {
-            bassignmidstr(down->tagname, down->tagname, 1, 
-                                    blength(down->tagname));
-
-            if (bstrcmp(down->tagname, tag->tagname) != 0) {
+            /* porovnanie bez úvodného '/' - reťazce dokumentu sú len
+               na čítanie, preto sa meno nemení na mieste */
+            if (blength(down->tagname) - 1 != blength(tag->tagname)
+                || memcmp(down->tagname->data + 1, tag->tagname->data,
+                          blength(tag->tagname)) != 0) {
                 print_error("Chyba - tag mismatch: '<%s>' je zatvoreny "
                             "ale posledny otvoreny je '<%s>'\n", 
-                            bdata(down->tagname), bdata(tag->tagname));
+                            bdata(down->tagname) + 1, bdata(tag->tagname));
                 exit(1);
             } else {
-                delete_tag(&down);
+                xml_droptag(down);
                 return tag;
             }
         }
-        vector_push_back(tag->downtags, &down); 
+        xml_append_child(tag, down); 
         /* Aj po end tagu pokračuj v parse*/
     }
     return tag;
 }
 
-static Vector *xml_atributelist(void)
+static Vector *xml_atributelist(XMLTag *owner, size_t hint)
 {
     XMLAtribut kv;
-    char begch;
-    Vector *v = vector_create(0, sizeof(XMLAtribut), delete_xmlatrib); 
+    Vector *v = NULL;
+    int rc, kbeg, klen, vbeg, vlen;
     
-    while (bchar(g_xmltext, g_filepos) != '>' 
-            && bchar(g_xmltext, g_filepos) != '/'
-            && bchar(g_xmltext, g_filepos) != '\0') {
-        
-        kv.key = xml_getlextoken('='); 
-        if (!kv.key) 
-            return NULL; 
-        
-        if (bchar(g_xmltext, g_filepos) != '=') {
-            print_error("Chyba: Ku klucu atributu neexistuje hodnota\n");
-            exit(1);
-        }
-
-        /* Parse - (key="value") / (key='value')*/ 
-        ++g_filepos; 
-        if ((begch = bchar(g_xmltext, g_filepos)) != '"' && begch != '\'') {
-             print_error("Chyba: Chybajuce otvaracie uvodzovky/apostrofy\n");
-             exit(1);
-        }
-        ++g_filepos; /* preskočenie na prvý znak za úvodzovkami */
-        
-        kv.value = xml_getlextoken(begch);
-        if (bchar(g_xmltext, g_filepos) != begch) {
-            print_error("Chyba: Chybajuce uzatvarajuce uvodzovky/apostrofy\n");
-            exit(1);
-        }
-        ++g_filepos; /* preskočenie za úvodzovky */
-        while (isspace(bchar(g_xmltext, g_filepos))) 
-            ++g_filepos;    /* preskočenie bielych znakov*/
+    while ((rc = xml_attrslice(&kbeg, &klen, &vbeg, &vlen)) > 0) {
+        kv.key = xml_newstr(g_xmltext->data + kbeg, klen);
+        kv.value = vlen < 0 ? NULL : xml_newstr(g_xmltext->data + vbeg, vlen);
 
+        /* vektor vznikne až s prvým atribútom */
+        if (v == NULL)
+            v = xml_newlist(1, hint);
         vector_push_back(v, &kv); 
+        if (g_doc != NULL && !vector_empty(g_doc->attrindex))
+            xml_indexattr(owner, &kv);
     }
+    
+    return rc < 0 ? NULL : v;
+}
 
-    if (vector_count(v) == 0) {
-        vector_release(v);
-        return NULL;
+/* Jeden atribút key="value" ako úseky textu. Vráti 1, 0 na konci
+ * zoznamu atribútov, -1 ak chýba kľúč. Prázdna hodnota má vlen -1 */
+static int xml_attrslice(int *kbeg, int *klen, int *vbeg, int *vlen)
+{
+    char begch;
+
+    if (bchar(g_xmltext, g_filepos) == '>' 
+        || bchar(g_xmltext, g_filepos) == '/'
+        || bchar(g_xmltext, g_filepos) == '\0') 
+        return 0;
+        
+    if ((*klen = xml_gettoken('=', kbeg)) < 0) 
+        return -1; 
+    
+    if (bchar(g_xmltext, g_filepos) != '=') {
+        print_error("Chyba: Ku klucu atributu neexistuje hodnota\n");
+        exit(1);
     }
+
+    /* Parse - (key="value") / (key='value')*/ 
+    ++g_filepos; 
+    if ((begch = bchar(g_xmltext, g_filepos)) != '"' && begch != '\'') {
+         print_error("Chyba: Chybajuce otvaracie uvodzovky/apostrofy\n");
+         exit(1);
+    }
+    ++g_filepos; /* preskočenie na prvý znak za úvodzovkami */
     
-    return v;
+    *vlen = xml_gettoken(begch, vbeg);
+    if (bchar(g_xmltext, g_filepos) != begch) {
+        print_error("Chyba: Chybajuce uzatvarajuce uvodzovky/apostrofy\n");
+        exit(1);
+    }
+    ++g_filepos; /* preskočenie za úvodzovky */
+    while (isspace(bchar(g_xmltext, g_filepos))) 
+        ++g_filepos;    /* preskočenie bielych znakov*/
+
+    return 1;
+}
+
+/* Zaradí uzol do indexu hodnôt atribútu, ak je jeho kľúč indexovaný.
+ * Zoznam všetkých uzlov vznikne až pri druhom výskyte hodnoty */
+static void xml_indexattr(XMLTag *owner, const XMLAtribut *kv)
+{
+    XMLAttrIndex *idx;
+    XMLAttrHit *hit;
+    void **slot;
+    size_t i;
+
+    if (kv->value == NULL)
+        return;
+    for (i = 0; i < vector_count(g_doc->attrindex); i++) {
+        idx = vector_at(g_doc->attrindex, i);
+        if (bstrcmp(idx->key, kv->key) != 0)
+            continue;
+        slot = xml_hash_slot(&idx->values, kv->value->data, 
+                             blength(kv->value));
+        if (slot == NULL)
+            return;
+        if ((hit = *slot) == NULL) {
+            if ((hit = arena_alloc(&g_doc->index, sizeof(XMLAttrHit))) 
+                == NULL)
+                return;
+            hit->first = owner;
+            hit->all = NULL;
+            *slot = hit;
+        } else if (hit->first != owner) {
+            if (hit->all == NULL) {
+                if ((hit->all = xml_newlist(0, 0)) == NULL)
+                    return;
+                vector_push_back(hit->all, &hit->first);
+            }
+            if (*(XMLTag **)vector_back(hit->all) != owner)
+                vector_push_back(hit->all, &owner);
+        }
+        return;
+    }
 }
 
 static XMLTag *xml_taginit(void) 
 {
-    XMLTag *tag = malloc(sizeof(XMLTag));
+    XMLTag *tag = g_doc ? arena_alloc(&g_doc->tags, sizeof(XMLTag)) 
+                        : malloc(sizeof(XMLTag));
     if (tag == NULL)
         return NULL;
 
@@ -290,6 +968,398 @@ static XMLTag *xml_taginit(void)
     return tag;
 }
 
+/* Reťazec z úseku textu - v režime dokumentu z arény, len na čítanie */
+static bstring xml_newstr(const unsigned char *s, int len)
+{
+    bstring b;
+
+    if (g_doc == NULL)
+        return blk2bstr(s, len);
+
+    b = arena_alloc(&g_doc->strings, sizeof(struct tagbstring));
+    if (b == NULL)
+        return NULL;
+    b->data = arena_alloc(&g_doc->bytes, len + 1);
+    if (b->data == NULL)
+        return NULL;
+    memcpy(b->data, s, len);
+    b->data[len] = '\0';
+    b->slen = len;
+    b->mlen = -1;   /* bwriteprotect - bstrlib ho nezmení ani neuvoľní */
+    return b;
+}
+
+/* Meno tagu - s indexom mien zdieľané všetkými uzlami s rovnakým menom
+ * (internované), uzatváracie tagy sa neinternujú */
+static bstring xml_newname(const unsigned char *s, int len)
+{
+    XMLNameEntry *entry;
+    void **slot;
+
+    if (g_doc == NULL || !(g_doc->indexes & XML_OPT_NAMEINDEX) || *s == '/')
+        return xml_newstr(s, len);
+
+    entry = xml_hash_get(&g_doc->names, s, len);
+    if (entry == NULL) {
+        entry = arena_alloc(&g_doc->index, sizeof(XMLNameEntry));
+        if (entry == NULL || (entry->name = xml_newstr(s, len)) == NULL
+            || (entry->nodes = xml_newlist(0, 0)) == NULL)
+            return NULL;
+        /* kľúčom je internovaná kópia, nie zdrojový text */
+        slot = xml_hash_slot(&g_doc->names, entry->name->data, len);
+        if (slot == NULL)
+            return NULL;
+        *slot = entry;
+    }
+    g_nameentry = entry;
+    return entry->name;
+}
+
+/* Vektor pre atribúty/potomkov - v režime dokumentu recyklovaný z poolu.
+ * hint je známy počet prvkov (0 - neznámy) */
+static Vector *xml_newlist(int atributes, size_t hint)
+{
+    XMLListPool *pool;
+    Vector *v;
+
+    if (g_doc == NULL) {
+        if (atributes)
+            return vector_create(hint, sizeof(XMLAtribut), delete_xmlatrib);
+        return vector_create(hint, sizeof(XMLTag *), NULL);
+    }
+    
+    pool = atributes ? &g_doc->atriblists : &g_doc->childlists;
+    if (pool->used < vector_count(pool->items)) {
+        v = *(Vector **)vector_at(pool->items, pool->used++);
+        vector_clear(v);
+        if (hint > vector_max_count(v))
+            vector_reserve_count(v, hint);
+        return v;
+    }
+
+    v = vector_create(hint, pool->elemsize, NULL);
+    if (v == NULL)
+        return NULL;
+    vector_push_back(pool->items, &v);
+    pool->used++;
+    return v;
+}
+
+/* Zahodenie pomocného uzla (uzatvárací tag) */
+static void xml_droptag(XMLTag *tag)
+{
+    if (g_doc == NULL)
+        delete_tag(&tag);
+}
+
+/* Rovnaká normalizácia ako xml_filetostr, ale do existujúceho bufferu */
+static void xml_readsource(bstring dst, bstring line, FILE *src)
+{
+    btrunc(dst, 0);
+    while (bassigngets(line, (bNgetc)fgetc, src, '\n') == 0) {
+        btrimws(line);
+        bconcat(dst, line);
+    }
+}
+
+/* Normalizácia textu z pamäte - po riadkoch ako xml_readsource */
+static void xml_readbuffer(bstring dst, const char *data, size_t len)
+{
+    const char *end = data + len, *eol;
+    const char *beg;
+
+    btrunc(dst, 0);
+    balloc(dst, len + 1);
+    while (data < end) {
+        eol = memchr(data, '\n', end - data);
+        eol = eol ? eol + 1 : end;
+        beg = data;
+        data = eol;
+        while (beg < eol && isspace((unsigned char)*beg))
+            ++beg;
+        while (eol > beg && isspace((unsigned char)eol[-1]))
+            --eol;
+        bcatblk(dst, beg, eol - beg);
+    }
+}
+
+static XMLTag *xml_builddoc(XMLDocument *doc)
+{
+    g_filepos = 0;
+    g_xmltext = doc->source;
+    g_doc = doc;
+    g_tagno = 0;
+    g_counts = NULL;
+    doc->indexes = doc->options & XML_OPT_NAMEINDEX;
+    if (doc->options & XML_OPT_PRESIZE) {
+        xml_prescan(doc);
+        g_counts = doc->counts;
+    }
+
+    doc->root = xml_buildtree();
+    g_doc = NULL;
+    g_xmltext = NULL;
+    g_counts = NULL;
+
+    return doc->root;
+}
+
+/* Predbežný lineárny prechod, ktorý spočíta tagy, atribúty a reťazce,
+ * aby sa arény dokumentu mohli alokovať naraz jedným blokom a vektory
+ * s presnou kapacitou. Počty sú presné pre korektné dokumenty, inak
+ * sú hornou hranicou */
+static void xml_prescan(XMLDocument *doc)
+{
+    const unsigned char *txt = doc->source->data;
+    int len = blength(doc->source);
+    int pos = 0, end;
+    size_t ntags = 0, nstrings = 0, tagno, *parent;
+    XMLCounts c, *cp;
+    char quote;
+
+    vector_clear(doc->counts);
+    vector_clear(doc->scanstack);
+    while ((pos = bstrchrp(doc->source, '<', pos)) != BSTR_ERR) {
+        ++pos;
+        if (txt[pos] == '!' || txt[pos] == '?')
+            continue;       /* xml_gettag hľadá ďalší '<' hneď za ním */
+        ++ntags;
+        nstrings += 2;      /* meno tagu a text za ním */
+        if (txt[pos] == '/') {
+            if (!vector_empty(doc->scanstack))
+                vector_pop_back(doc->scanstack);
+            continue;
+        }
+
+        /* otvárací tag - atribúty po '>' mimo úvodzoviek */
+        c.children = 0;
+        c.atributes = 0;
+        for (end = pos, quote = 0; end < len; end++) {
+            if (quote) {
+                if (txt[end] == quote)
+                    quote = 0;
+            } else if (txt[end] == '"' || txt[end] == '\'') {
+                quote = txt[end];
+            } else if (txt[end] == '=') {
+                ++c.atributes;
+            } else if (txt[end] == '>') {
+                break;
+            }
+        }
+        nstrings += 2 * c.atributes;
+        
+        tagno = vector_count(doc->counts);
+        vector_push_back(doc->counts, &c);
+        if (!vector_empty(doc->scanstack)) {
+            parent = vector_back(doc->scanstack);
+            cp = vector_at(doc->counts, *parent);
+            ++cp->children;
+        }
+        if (end < len && txt[end - 1] != '/')
+            vector_push_back(doc->scanstack, &tagno);
+        pos = end;
+    }
+
+    arena_reserve(&doc->tags, ntags * XML_ALIGN(sizeof(XMLTag)));
+    arena_reserve(&doc->strings, 
+                  nstrings * XML_ALIGN(sizeof(struct tagbstring)));
+    arena_reserve(&doc->bytes, len + nstrings * sizeof(void *));
+}
+
+static void arena_init(XMLArena *arena, size_t blocksize)
+{
+    arena->blocks = vector_create(0, sizeof(XMLBlock), NULL);
+    arena->current = 0;
+    arena->blocksize = blocksize;
+}
+
+static void *arena_alloc(XMLArena *arena, size_t size)
+{
+    XMLBlock *blk, newblk;
+    void *ptr;
+    
+    size = XML_ALIGN(size);
+    while (arena->current < vector_count(arena->blocks)) {
+        blk = vector_at(arena->blocks, arena->current);
+        if (blk->size - blk->used >= size) {
+            ptr = blk->data + blk->used;
+            blk->used += size;
+            return ptr;
+        }
+        /* nasledujúci blok sa resetuje až pri prvom použití */
+        if (++arena->current < vector_count(arena->blocks))
+            ((XMLBlock *)vector_at(arena->blocks, arena->current))->used = 0;
+    }
+
+    newblk.size = size > arena->blocksize ? size : arena->blocksize;
+    newblk.data = malloc(newblk.size);
+    if (newblk.data == NULL)
+        return NULL;
+    newblk.used = size;
+    vector_push_back(arena->blocks, &newblk);
+    return newblk.data;
+}
+
+/* Zabezpečí, že prvý blok čerstvo resetovanej arény pojme size bajtov */
+static void arena_reserve(XMLArena *arena, size_t size)
+{
+    XMLBlock blk;
+
+    if (vector_count(arena->blocks) > 0 
+        && ((XMLBlock *)vector_front(arena->blocks))->size >= size)
+        return;
+
+    blk.size = size;
+    blk.used = 0;
+    blk.data = malloc(size);
+    if (blk.data != NULL)
+        vector_insert(arena->blocks, 0, &blk);
+}
+
+static void arena_reset(XMLArena *arena)
+{
+    arena->current = 0;
+    if (vector_count(arena->blocks) > 0)
+        ((XMLBlock *)vector_front(arena->blocks))->used = 0;
+}
+
+static void arena_release(XMLArena *arena)
+{
+    size_t i;
+    if (arena->blocks == NULL)
+        return;
+    for (i = 0; i < vector_count(arena->blocks); i++)
+        free(((XMLBlock *)vector_at(arena->blocks, i))->data);
+    vector_release(arena->blocks);
+}
+
+static void listpool_init(XMLListPool *pool, size_t elemsize)
+{
+    pool->items = vector_create(0, sizeof(Vector *), NULL);
+    pool->used = 0;
+    pool->elemsize = elemsize;
+}
+
+static void listpool_release(XMLListPool *pool)
+{
+    size_t i;
+    if (pool->items == NULL)
+        return;
+    for (i = 0; i < vector_count(pool->items); i++)
+        vector_release(*(Vector **)vector_at(pool->items, i));
+    vector_release(pool->items);
+}
+
+/* Dopĺňa okno riadkami vstupu, kým neobsahuje znak delim od pozície 
+ * from. Vráti jeho index, alebo BSTR_ERR na konci vstupu */
+static int reader_fill(XMLReader *r, char delim, int from)
+{
+    int idx, len;
+
+    for (;;) {
+        if ((idx = bstrchrp(r->window, delim, from)) != BSTR_ERR)
+            return idx;
+        if (r->eof)
+            return BSTR_ERR;
+        
+        len = blength(r->window);
+        from = len > from ? len : from;
+        if (bassigngets(r->line, (bNgetc)fgetc, r->src, '\n') != 0) {
+            r->eof = 1;
+            continue;
+        }
+        btrimws(r->line);
+        bconcat(r->window, r->line);
+    }
+}
+
+/* Zahodí spracovaný začiatok okna, keď tvorí väčšinu okna */
+static void reader_compact(XMLReader *r)
+{
+    if (r->pos < XML_BLOCKSIZE / 16 || r->pos * 2 < blength(r->window))
+        return;
+    bdelete(r->window, 0, r->pos);
+    r->pos = 0;
+}
+
+static void reader_pop(XMLReader *r)
+{
+    btrunc(r->names, *(int *)vector_back(r->open));
+    vector_pop_back(r->open);
+}
+
+static void xml_reclaim(XMLTag *root, XMLDocument *doc)
+{
+    XMLReclaimItem item;
+    int queued = 0;
+
+    item.root = root;
+    item.doc = doc;
+    pthread_once(&g_reclaim_once, reclaim_start);
+
+    pthread_mutex_lock(&g_reclaim_lock);
+    if (g_reclaim_started && vector_push_back(g_reclaim_queue, &item)) {
+        queued = 1;
+        pthread_cond_signal(&g_reclaim_work);
+    }
+    pthread_mutex_unlock(&g_reclaim_lock);
+
+    if (!queued) {
+        xml_freetree(root);
+        xml_doc_release(doc);
+    }
+}
+
+static void reclaim_start(void)
+{
+    pthread_t thread;
+
+    g_reclaim_queue = vector_create(0, sizeof(XMLReclaimItem), NULL);
+    if (g_reclaim_queue == NULL)
+        return;
+    if (pthread_create(&thread, NULL, reclaim_thread, NULL) != 0)
+        return;
+    pthread_detach(thread);
+    g_reclaim_started = 1;
+}
+
+/* Vyberie naraz celý front a uvoľňuje mimo zámku */
+static void *reclaim_thread(void *arg)
+{
+    Vector *batch = vector_create(0, sizeof(XMLReclaimItem), NULL), *tmp;
+    XMLReclaimItem *item;
+    size_t i;
+    (void)arg;
+
+    if (batch == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&g_reclaim_lock);
+    for (;;) {
+        while (vector_empty(g_reclaim_queue)) {
+            g_reclaim_busy = 0;
+            pthread_cond_broadcast(&g_reclaim_idle);
+            pthread_cond_wait(&g_reclaim_work, &g_reclaim_lock);
+        }
+        tmp = g_reclaim_queue;
+        g_reclaim_queue = batch;
+        batch = tmp;
+        g_reclaim_busy = 1;
+        pthread_mutex_unlock(&g_reclaim_lock);
+
+        for (i = 0; i < vector_count(batch); i++) {
+            item = vector_at(batch, i);
+            xml_freetree(item->root);
+            xml_doc_release(item->doc);
+        }
+        vector_clear(batch);
+
+        pthread_mutex_lock(&g_reclaim_lock);
+    }
+    return NULL;
+}
+
+/* Uvoľní jediný uzol - potomkov rieši volajúci (xml_freetree) */
 static void delete_tag(void *item)
 {
     bdestroy((*(XMLTag **)item)->tagname);
@@ -300,6 +1370,7 @@ static void delete_tag(void *item)
     if ((*(XMLTag **)item)->downtags != NULL) {
         vector_release((*(XMLTag **)item)->downtags);
     } 
+    free(*(XMLTag **)item);
 }
 
 static void delete_xmlatrib(void *data)
@@ -308,46 +1379,61 @@ static void delete_xmlatrib(void *data)
     bdestroy((*(XMLAtribut *)data).value); 
 }
 
-static bstring xml_getlextoken(char terminator)
+static void delete_attrindex(void *data)
+{
+    bdestroy(((XMLAttrIndex *)data)->key);
+    xml_hash_free(&((XMLAttrIndex *)data)->values);
+}
+
+/* Nájde lexikálny token bez alokácie - vráti jeho dĺžku a začiatok
+ * v *beg, alebo -1 ak token chýba */
+static int xml_lexslice(char terminator, int *beg)
 {
     char z;
-    bstring word = bfromcstr("");
     
     /* Preskočíme všetky medzery medzi < a názvom tagu */
-    for ( ; isspace(z = bchar(g_xmltext, g_filepos)); g_filepos++) {
-        if (z == '\0')  
-            return NULL;
-    }
+    for ( ; isspace(z = bchar(g_xmltext, g_filepos)); g_filepos++) 
+        ;
 
     /* číta po terminátor alebo koniec tagu */
+    *beg = g_filepos;
     while ((z = bchar(g_xmltext, g_filepos)) != terminator && z != '>') {
-        if (z == '\0') {
-            bdestroy(word);
-            return NULL;
-        } 
-        if ((bchar(g_xmltext, g_filepos)) == '/' 
-            && bchar(g_xmltext, g_filepos + 1)== '>') {
+        if (z == '\0') 
+            return -1;
+        if (z == '/' && bchar(g_xmltext, g_filepos + 1) == '>') 
             break;
-        }
-        bconchar(word, z);
         ++g_filepos;
     }
 
+    if (g_filepos == *beg) 
+        return -1;
+    return g_filepos - *beg;
+}
+
+/* Token ako úsek textu, za ním sa preskočia biele znaky */
+static int xml_gettoken(char terminator, int *beg)
+{
+    char z;
+    int len = xml_lexslice(terminator, beg);
+    
+    if (len < 0)
+        return -1;
+
     /* nastav sa ďalší nebiely znak */
     while (isspace(z = bchar(g_xmltext, g_filepos)) && z != '\0')
         ++g_filepos;
 
-    if (!blength(word) || z == '\0') {
-        bdestroy(word);
-        return NULL;
-    }
-    return word;
+    if (z == '\0') 
+        return -1;
+    return len;
 }
 
 static bstring xml_gettag(void)
 {
     char ch;
+    int beg, len;
 
+    g_nameentry = NULL;
     if (g_xmltext == NULL || g_xmltext->data == NULL 
         || g_xmltext->slen <= g_filepos || g_filepos < 0)
 		return NULL;
@@ -362,25 +1448,21 @@ static bstring xml_gettag(void)
         return xml_gettag();
     }
 
-    return xml_getlextoken(' ');
+    if ((len = xml_gettoken(' ', &beg)) < 0)
+        return NULL;
+    return xml_newname(g_xmltext->data + beg, len);
 }
 
 static bstring xml_tagtext(void)
 {
-    char z;
-    bstring txt = bfromcstr("");
-    if (!txt) 
-        return NULL;
+    int beg = g_filepos;
+    int end = bstrchrp(g_xmltext, '<', g_filepos);
 
-    while ((z = bchar(g_xmltext, g_filepos)) != '<' && z != '\0') {
-        bconchar(txt, z);
-        ++g_filepos;
-    }
+    if (end == BSTR_ERR)
+        end = blength(g_xmltext);
+    g_filepos = end;
 
-    if (!blength(txt)) {
-        bdestroy(txt);
+    if (end == beg) 
         return NULL;
-    }
-
-    return txt;
+    return xml_newstr(g_xmltext->data + beg, end - beg);
 }
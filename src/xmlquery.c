@@ -0,0 +1,701 @@
+/*
+ * xmlquery.c
+ * Kompilované dotazy na strom (podmnožina XPath) - dotaz sa raz preloží
+ * na program krokov a ten sa vykonáva nad stromom po množinách uzlov.
+ * Ak má dokument index mien alebo hodnôt atribútov, prvý krok '//'
+ * ho použije namiesto prechodu stromom. Dotazy bez pozičných predikátov
+ * sa dajú vyhodnocovať aj prúdovo počas čítania vstupu
+ *
+ * Licencia: MIT / LGPLv2
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "xmlquery.h"
+#include "xmlparser.h"
+#include "bstrlib.h"
+#include "vector.h"
+
+#define XML_QUERY_SPECIAL   "/[]@='\"*"
+#define XML_STREAM_MAXSTEPS (sizeof(unsigned long) * 8)
+
+/* Poradie uzla v dokumente pre triedenie výsledkov */
+typedef struct {
+    XMLTag *tag;
+    size_t rank;
+} XMLRank;
+
+/* Lokálne funkcie - prototypy */
+static const char *query_name(const char *p, bstring *name);
+static const char *query_predicate(const char *p, XMLPredicate *pred);
+static int query_error(const char *expr, const char *p, const char *msg);
+static void query_candidates(const XMLStep *step, XMLTag *ctx, XMLTag *root,
+                             Vector *out);
+static int query_fromindex(const XMLStep *step, const XMLDocument *doc,
+                           Vector *out);
+static void query_filter(const XMLStep *step, size_t from, Vector *nodes);
+static int pred_match(const XMLPredicate *pred, XMLTag *elem);
+static Vector *query_ranks(XMLTag *root);
+static void query_sort(Vector *nodes, Vector *ranks);
+static int rank_byptr(const void *a, const void *b);
+static int rank_byrank(const void *a, const void *b);
+static long stream_queries(const XMLQuery **queries, size_t n, FILE *src,
+                           XMLMatchFn onmatch, void *ctx);
+static int stream_check(const XMLQuery *query);
+static unsigned long stream_mask(const XMLQuery *query, unsigned long mask,
+                                 const XMLEvent *ev, int *matched);
+static int event_match(const XMLStep *step, const XMLEvent *ev);
+static int slice_eq(const XMLSlice *slice, const_bstring b);
+static void delete_step(void *data);
+
+XMLQuery *xml_query_compile(const char *expr)
+{
+    XMLQuery *query;
+    XMLStep step;
+    XMLPredicate pred;
+    const char *p = expr, *beg;
+
+    query = malloc(sizeof(XMLQuery));
+    if (query == NULL)
+        return NULL;
+    query->absolute = (*p == '/');
+    query->steps = vector_create(0, sizeof(XMLStep), delete_step);
+    if (query->steps == NULL) {
+        free(query);
+        return NULL;
+    }
+
+    while (*p != '\0') {
+        step.axis = XML_AXIS_CHILD;
+        if (p[0] == '/' && p[1] == '/') {
+            step.axis = XML_AXIS_DESCENDANT;
+            p += 2;
+        } else if (*p == '/') {
+            ++p;
+        } else if (!vector_empty(query->steps)) {
+            query_error(expr, p, "ocakavane '/'");
+            goto fail;
+        }
+
+        /* test mena */
+        step.name = NULL;
+        beg = p;
+        if (*p == '*') {
+            ++p;
+        } else if ((p = query_name(p, &step.name)) == NULL) {
+            query_error(expr, beg, "chyba meno kroku");
+            goto fail;
+        }
+
+        step.preds = vector_create(0, sizeof(XMLPredicate), NULL);
+        vector_push_back(query->steps, &step);
+        while (*p == '[') {
+            beg = p;
+            if ((p = query_predicate(p + 1, &pred)) == NULL) {
+                query_error(expr, beg, "chybny predikat");
+                goto fail;
+            }
+            vector_push_back(step.preds, &pred);
+        }
+    }
+
+    if (vector_empty(query->steps)) {
+        query_error(expr, p, "prazdny dotaz");
+        goto fail;
+    }
+    return query;
+
+fail:
+    xml_query_free(query);
+    return NULL;
+}
+
+void xml_query_free(XMLQuery *query)
+{
+    if (query == NULL)
+        return;
+    vector_release(query->steps);
+    free(query);
+}
+
+/* Vykoná dotaz nad stromom s koreňom/kontextom context a výsledky
+ * (XMLTag *) v poradí dokumentu bez duplicít pridá do out. doc môže byť
+ * NULL. Vráti počet nájdených uzlov alebo -1 ak chýba pamäť */
+int xml_query_run(const XMLQuery *query, XMLTag *context,
+                  const XMLDocument *doc, Vector *out)
+{
+    Vector *cur, *next, *tmp, *ranks = NULL;
+    XMLTag *none = NULL;
+    const XMLStep *step;
+    size_t i, j, from;
+    int nested = 0, result;
+
+    if (context == NULL)
+        return 0;
+    cur = vector_create(0, sizeof(XMLTag *), NULL);
+    next = vector_create(0, sizeof(XMLTag *), NULL);
+    if (cur == NULL || next == NULL) {
+        result = -1;
+        goto done;
+    }
+
+    /* NULL v množine kontextov zastupuje dokumentový uzol nad koreňom */
+    vector_push_back(cur, query->absolute ? &none : &context);
+    for (i = 0; i < vector_count(query->steps); i++) {
+        step = vector_at(query->steps, i);
+        vector_clear(next);
+
+        if (i > 0 || !query->absolute || doc == NULL || doc->root != context
+            || query_fromindex(step, doc, next) != 0) {
+            for (j = 0; j < vector_count(cur); j++) {
+                from = vector_count(next);
+                query_candidates(step, *(XMLTag **)vector_at(cur, j),
+                                 context, next);
+                query_filter(step, from, next);
+            }
+        }
+
+        /* kontexty do seba vnorené (po kroku '//') môžu dať výsledky
+           mimo poradia dokumentu alebo viackrát */
+        if (nested && vector_count(cur) > 1) {
+            if (ranks == NULL && (ranks = query_ranks(context)) == NULL) {
+                result = -1;
+                goto done;
+            }
+            query_sort(next, ranks);
+        }
+        nested |= step->axis == XML_AXIS_DESCENDANT;
+
+        tmp = cur;
+        cur = next;
+        next = tmp;
+        if (vector_empty(cur))
+            break;
+    }
+
+    result = vector_count(cur);
+    if (result > 0)
+        vector_append(out, vector_data(cur), vector_count(cur));
+
+done:
+    if (cur != NULL)
+        vector_release(cur);
+    if (next != NULL)
+        vector_release(next);
+    if (ranks != NULL)
+        vector_release(ranks);
+    return result;
+}
+
+/* Prvý výsledok dotazu v poradí dokumentu, alebo NULL */
+XMLTag *xml_query_first(const XMLQuery *query, XMLTag *context,
+                        const XMLDocument *doc)
+{
+    Vector *out = vector_create(0, sizeof(XMLTag *), NULL);
+    XMLTag *first = NULL;
+
+    if (out == NULL)
+        return NULL;
+    if (xml_query_run(query, context, doc, out) > 0)
+        first = *(XMLTag **)vector_front(out);
+    vector_release(out);
+    return first;
+}
+
+/* Test mena a atribútových predikátov kroku na jednom uzle (bez pozície) */
+int xml_match_step(const XMLStep *step, XMLTag *elem)
+{
+    const XMLPredicate *pred;
+    size_t i;
+
+    if (step->name != NULL && bstrcmp(step->name, elem->tagname) != 0)
+        return 0;
+    for (i = 0; i < vector_count(step->preds); i++) {
+        pred = vector_at(step->preds, i);
+        if (pred->type != XML_PRED_POSITION && !pred_match(pred, elem))
+            return 0;
+    }
+    return 1;
+}
+
+/* Prúdové vyhodnotenie dotazu počas čítania src. Strom sa buduje iba
+ * pre vyhovujúce elementy - každý podstrom dostane onmatch do vlastníctva
+ * (uvoľní ho xml_freetree). Ostatné elementy sa len prečítajú, pamäť
+ * závisí od hĺbky a nie od veľkosti vstupu. Zhody vnorené do inej zhody
+ * sú súčasťou jej podstromu. Ak onmatch vráti XML_VISIT_STOP, čítanie
+ * skončí. Vráti počet zhôd, alebo -1 pre dotaz s pozičným predikátom */
+long xml_query_stream(const XMLQuery *query, FILE *src, 
+                      XMLMatchFn onmatch, void *ctx)
+{
+    return stream_queries(&query, 1, src, onmatch, ctx);
+}
+
+/* Automat nad udalosťami čítačky - pre každý otvorený element a dotaz
+ * množina krokov (bitová maska), ktoré môžu nasledovať pod ním */
+static long stream_queries(const XMLQuery **queries, size_t n, FILE *src,
+                           XMLMatchFn onmatch, void *ctx)
+{
+    XMLReader *r;
+    XMLEvent ev;
+    Vector *masks = NULL, *build = NULL;
+    XMLTag *tag;
+    unsigned long *parent, m;
+    size_t q, skipdepth = 0, matchdepth = 0;
+    int skipping = 0, matched, stop = 0;
+    long count = 0;
+
+    for (q = 0; q < n; q++) {
+        if (stream_check(queries[q]) != 0)
+            return -1;
+    }
+
+    r = xml_reader_open(src);
+    masks = vector_create(0, sizeof(unsigned long), NULL);
+    build = vector_create(0, sizeof(XMLTag *), NULL);
+    if (r == NULL || masks == NULL || build == NULL) {
+        count = -1;
+        goto done;
+    }
+
+    while (!stop && xml_reader_next(r, &ev) != XML_EV_EOF) {
+        if (!vector_empty(build)) {
+            /* vnútri zhody - budovanie podstromu */
+            if (ev.type == XML_EV_START) {
+                tag = xml_event_tag(&ev);
+                xml_append_child(*(XMLTag **)vector_back(build), tag);
+                vector_push_back(build, &tag);
+            } else if (ev.type == XML_EV_TEXT) {
+                tag = *(XMLTag **)vector_back(build);
+                tag->text = blk2bstr(ev.text.data, ev.text.len);
+            } else if (ev.depth == matchdepth) {
+                tag = *(XMLTag **)vector_front(build);
+                vector_clear(build);
+                ++count;
+                stop = onmatch(tag, ctx) == XML_VISIT_STOP;
+            } else {
+                vector_pop_back(build);
+            }
+            continue;
+        }
+
+        if (skipping) {
+            if (ev.type == XML_EV_END && ev.depth == skipdepth)
+                skipping = 0;
+            continue;
+        }
+
+        if (ev.type == XML_EV_END) {
+            vector_erase_range(masks, vector_count(masks) - n, 
+                               vector_count(masks));
+            continue;
+        }
+        if (ev.type != XML_EV_START)
+            continue;
+
+        /* masky elementu z masiek rodiča (koreň - dokumentový uzol) */
+        matched = 0;
+        m = 0;
+        parent = ev.depth == 0 ? NULL 
+               : vector_at(masks, vector_count(masks) - n);
+        for (q = 0; q < n; q++) {
+            unsigned long own;
+            if (parent == NULL)
+                own = queries[q]->absolute 
+                    ? stream_mask(queries[q], 1UL, &ev, &matched) : 1UL;
+            else 
+                own = stream_mask(queries[q], parent[q], &ev, &matched);
+            vector_push_back(masks, &own);
+            m |= own;
+        }
+
+        if (matched) {
+            vector_erase_range(masks, vector_count(masks) - n, 
+                               vector_count(masks));
+            tag = xml_event_tag(&ev);
+            vector_push_back(build, &tag);
+            matchdepth = ev.depth;
+            if (ev.selfclosing || tag == NULL) 
+                continue;
+        } else if (m == 0) {
+            /* pod elementom už nič nevyhovie - len ho preskočiť */
+            vector_erase_range(masks, vector_count(masks) - n, 
+                               vector_count(masks));
+            skipping = 1;
+            skipdepth = ev.depth;
+        }
+    }
+
+    /* predčasne zastavené budovanie */
+    if (!vector_empty(build))
+        xml_freetree(*(XMLTag **)vector_front(build));
+
+done:
+    xml_reader_close(r);
+    if (masks != NULL)
+        vector_release(masks);
+    if (build != NULL)
+        vector_release(build);
+    return count;
+}
+
+static int stream_check(const XMLQuery *query)
+{
+    const XMLStep *step;
+    size_t i, j;
+
+    if (vector_count(query->steps) >= XML_STREAM_MAXSTEPS) {
+        fprintf(stderr, "Chyba dotazu: prilis vela krokov\n");
+        return -1;
+    }
+    for (i = 0; i < vector_count(query->steps); i++) {
+        step = vector_at(query->steps, i);
+        for (j = 0; j < vector_count(step->preds); j++) {
+            if (((XMLPredicate *)vector_at(step->preds, j))->type 
+                == XML_PRED_POSITION) {
+                fprintf(stderr, "Chyba dotazu: pozicny predikat sa neda "
+                                "vyhodnotit prudovo\n");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Kroky čakajúce pod elementom ev, ak nad ním čakali kroky mask */
+static unsigned long stream_mask(const XMLQuery *query, unsigned long mask,
+                                 const XMLEvent *ev, int *matched)
+{
+    const XMLStep *step;
+    unsigned long own = 0;
+    size_t i, n = vector_count(query->steps);
+
+    for (i = 0; i < n; i++) {
+        if (!(mask & (1UL << i)))
+            continue;
+        step = vector_at(query->steps, i);
+        if (step->axis == XML_AXIS_DESCENDANT)
+            own |= 1UL << i;
+        if (event_match(step, ev)) {
+            if (i + 1 == n)
+                *matched = 1;
+            else
+                own |= 1UL << (i + 1);
+        }
+    }
+    return own;
+}
+
+/* xml_match_step nad udalosťou - bez alokácie */
+static int event_match(const XMLStep *step, const XMLEvent *ev)
+{
+    const XMLPredicate *pred;
+    const XMLAttrSlice *atr;
+    size_t i, j;
+
+    if (step->name != NULL && !slice_eq(&ev->name, step->name))
+        return 0;
+    for (i = 0; i < vector_count(step->preds); i++) {
+        pred = vector_at(step->preds, i);
+        for (j = 0, atr = NULL; j < ev->nattrs; j++) {
+            if (slice_eq(&ev->attrs[j].key, pred->key)) {
+                atr = &ev->attrs[j];
+                break;
+            }
+        }
+        if (atr == NULL)
+            return 0;
+        if (pred->type == XML_PRED_ATTR && !(atr->value.data == NULL 
+                ? blength(pred->value) == 0 
+                : slice_eq(&atr->value, pred->value)))
+            return 0;
+    }
+    return 1;
+}
+
+static int slice_eq(const XMLSlice *slice, const_bstring b)
+{
+    return slice->len == blength(b) 
+        && memcmp(slice->data, b->data, slice->len) == 0;
+}
+
+static const char *query_name(const char *p, bstring *name)
+{
+    const char *beg = p;
+
+    while (*p != '\0' && strchr(XML_QUERY_SPECIAL, *p) == NULL
+           && !isspace((unsigned char)*p))
+        ++p;
+    if (p == beg)
+        return NULL;
+    *name = blk2bstr(beg, p - beg);
+    return p;
+}
+
+/* p ukazuje za '[' - vráti pozíciu za ']' */
+static const char *query_predicate(const char *p, XMLPredicate *pred)
+{
+    const char *beg;
+    char quote;
+
+    pred->key = NULL;
+    pred->value = NULL;
+    pred->position = 0;
+
+    if (*p == '@') {
+        if ((p = query_name(p + 1, &pred->key)) == NULL)
+            return NULL;
+        pred->type = XML_PRED_HASATTR;
+        if (*p == '=') {
+            quote = *++p;
+            if (quote != '\'' && quote != '"')
+                goto fail;
+            beg = ++p;
+            while (*p != '\0' && *p != quote)
+                ++p;
+            if (*p != quote)
+                goto fail;
+            pred->type = XML_PRED_ATTR;
+            pred->value = blk2bstr(beg, p - beg);
+            ++p;
+        }
+    } else if (isdigit((unsigned char)*p)) {
+        pred->type = XML_PRED_POSITION;
+        while (isdigit((unsigned char)*p))
+            pred->position = pred->position * 10 + (*p++ - '0');
+        if (pred->position == 0)
+            return NULL;
+    } else {
+        return NULL;
+    }
+
+    if (*p == ']') 
+        return p + 1;
+
+fail:
+    bdestroy(pred->key);
+    bdestroy(pred->value);
+    return NULL;
+}
+
+static int query_error(const char *expr, const char *p, const char *msg)
+{
+    fprintf(stderr, "Chyba dotazu: %s\n\t%s\n\t%*s^~~~~\n",
+            msg, expr, (int)(p - expr), "");
+    return -1;
+}
+
+/* Uzly kroku z jedného kontextu, ktoré prejdú testom mena */
+static void query_candidates(const XMLStep *step, XMLTag *ctx, XMLTag *root,
+                             Vector *out)
+{
+    XMLIter it;
+    XMLTag *tag;
+    size_t i;
+
+    if (ctx == NULL) {
+        /* dokumentový uzol - jediným dieťaťom je koreň */
+        if (step->axis == XML_AXIS_CHILD) {
+            if (step->name == NULL || bstrcmp(step->name, root->tagname) == 0)
+                vector_push_back(out, &root);
+            return;
+        }
+        ctx = root;
+        if (step->name == NULL || bstrcmp(step->name, root->tagname) == 0)
+            vector_push_back(out, &root);
+    }
+
+    if (step->axis == XML_AXIS_CHILD) {
+        if (ctx->downtags == NULL)
+            return;
+        for (i = 0; i < vector_count(ctx->downtags); i++) {
+            tag = *(XMLTag **)vector_at(ctx->downtags, i);
+            if (step->name == NULL || bstrcmp(step->name, tag->tagname) == 0)
+                vector_push_back(out, &tag);
+        }
+        return;
+    }
+
+    if (xml_iter_begin(&it, ctx, XML_PREORDER) != 0)
+        return;
+    xml_iter_next(&it);     /* samotný kontext nie je potomkom */
+    while ((tag = xml_iter_next(&it)) != NULL) {
+        if (step->name == NULL || bstrcmp(step->name, tag->tagname) == 0)
+            vector_push_back(out, &tag);
+    }
+    xml_iter_end(&it);
+}
+
+/* Prvý krok '//' nad celým dokumentom z indexu. Vráti -1, ak sa index
+ * použiť nedá a treba prechádzať strom */
+static int query_fromindex(const XMLStep *step, const XMLDocument *doc,
+                           Vector *out)
+{
+    const XMLPredicate *pred = NULL;
+    XMLTag **nodes;
+    size_t n, i;
+
+    if (step->axis != XML_AXIS_DESCENDANT)
+        return -1;
+
+    if (!vector_empty(step->preds))
+        pred = vector_front(step->preds);
+    if (pred != NULL && pred->type == XML_PRED_ATTR
+        && xml_find_all_by_attr(doc, bdata(pred->key), bdata(pred->value),
+                                &nodes, &n) == 0) {
+        for (i = 0; i < n; i++) {
+            if (step->name == NULL
+                || bstrcmp(step->name, nodes[i]->tagname) == 0)
+                vector_push_back(out, &nodes[i]);
+        }
+    } else if (step->name != NULL
+               && xml_find_by_name(doc, bdata(step->name), &nodes, &n) == 0) {
+        if (n > 0)
+            vector_append(out, nodes, n);
+    } else {
+        return -1;
+    }
+
+    query_filter(step, 0, out);
+    return 0;
+}
+
+/* Predikáty kroku v poradí zápisu na uzly out[from..] jedného kontextu */
+static void query_filter(const XMLStep *step, size_t from, Vector *nodes)
+{
+    const XMLPredicate *pred;
+    XMLTag *tag;
+    size_t i, j, keep;
+
+    for (i = 0; i < vector_count(step->preds); i++) {
+        pred = vector_at(step->preds, i);
+        if (pred->type == XML_PRED_POSITION) {
+            if (from + pred->position - 1 < vector_count(nodes)) {
+                tag = *(XMLTag **)vector_at(nodes, from + pred->position - 1);
+                vector_erase_range(nodes, from, vector_count(nodes));
+                vector_push_back(nodes, &tag);
+            } else {
+                vector_erase_range(nodes, from, vector_count(nodes));
+            }
+            continue;
+        }
+
+        for (j = keep = from; j < vector_count(nodes); j++) {
+            tag = *(XMLTag **)vector_at(nodes, j);
+            if (pred_match(pred, tag))
+                vector_replace(nodes, keep++, &tag);
+        }
+        vector_erase_range(nodes, keep, vector_count(nodes));
+    }
+}
+
+static int pred_match(const XMLPredicate *pred, XMLTag *elem)
+{
+    XMLAtribut *atr;
+    size_t i;
+
+    if (elem->atribut == NULL)
+        return 0;
+    for (i = 0; i < vector_count(elem->atribut); i++) {
+        atr = vector_at(elem->atribut, i);
+        if (bstrcmp(atr->key, pred->key) != 0)
+            continue;
+        if (pred->type == XML_PRED_HASATTR)
+            return 1;
+        if (atr->value == NULL)
+            return blength(pred->value) == 0;
+        return bstrcmp(atr->value, pred->value) == 0;
+    }
+    return 0;
+}
+
+/* Tabuľka poradia uzlov stromu zoradená podľa adresy */
+static Vector *query_ranks(XMLTag *root)
+{
+    Vector *ranks = vector_create(0, sizeof(XMLRank), NULL);
+    XMLRank r;
+    XMLIter it;
+
+    if (ranks == NULL)
+        return NULL;
+    if (xml_iter_begin(&it, root, XML_PREORDER) != 0) {
+        vector_release(ranks);
+        return NULL;
+    }
+    r.rank = 0;
+    while ((r.tag = xml_iter_next(&it)) != NULL) {
+        vector_push_back(ranks, &r);
+        r.rank++;
+    }
+    xml_iter_end(&it);
+
+    qsort(vector_data(ranks), vector_count(ranks), sizeof(XMLRank),
+          rank_byptr);
+    return ranks;
+}
+
+/* Zoradí uzly do poradia dokumentu a odstráni duplicity */
+static void query_sort(Vector *nodes, Vector *ranks)
+{
+    XMLRank key, *found, *sorted;
+    size_t i, n = vector_count(nodes), keep;
+
+    if (n < 2)
+        return;
+    sorted = malloc(n * sizeof(XMLRank));
+    if (sorted == NULL)
+        return;
+
+    for (i = 0; i < n; i++) {
+        key.tag = *(XMLTag **)vector_at(nodes, i);
+        found = bsearch(&key, vector_data(ranks), vector_count(ranks),
+                        sizeof(XMLRank), rank_byptr);
+        sorted[i].tag = key.tag;
+        sorted[i].rank = found ? found->rank : 0;
+    }
+    qsort(sorted, n, sizeof(XMLRank), rank_byrank);
+
+    vector_clear(nodes);
+    for (i = keep = 0; i < n; i++) {
+        if (keep > 0 && sorted[keep - 1].tag == sorted[i].tag)
+            continue;
+        sorted[keep++] = sorted[i];
+        vector_push_back(nodes, &sorted[i].tag);
+    }
+    free(sorted);
+}
+
+static int rank_byptr(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)((const XMLRank *)a)->tag;
+    uintptr_t y = (uintptr_t)((const XMLRank *)b)->tag;
+    return (x > y) - (x < y);
+}
+
+static int rank_byrank(const void *a, const void *b)
+{
+    size_t x = ((const XMLRank *)a)->rank;
+    size_t y = ((const XMLRank *)b)->rank;
+    return (x > y) - (x < y);
+}
+
+static void delete_predicate(void *data)
+{
+    bdestroy(((XMLPredicate *)data)->key);
+    bdestroy(((XMLPredicate *)data)->value);
+}
+
+static void delete_step(void *data)
+{
+    XMLStep *step = data;
+    size_t i;
+
+    bdestroy(step->name);
+    if (step->preds == NULL)
+        return;
+    for (i = 0; i < vector_count(step->preds); i++)
+        delete_predicate(vector_at(step->preds, i));
+    vector_release(step->preds);
+}